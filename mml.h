@@ -0,0 +1,106 @@
+/**
+ * C interface to mml.cpp, for linking the player into C programs, or
+ * anything else that can call C, like Go through cgo.
+ *
+ * A renderer is set up once with mml_create, which does all of the
+ * allocation, and can then load and render any number of songs up to the
+ * size it was created for without allocating. Nothing throws; every call
+ * that can fail returns an mml_status, and after a failed load
+ * mml_error_message and mml_error_position say what was wrong and where.
+ * Audio is rendered into buffers owned by the caller.
+ *
+ *   mml_renderer *r = mml_create(44100, 4096);
+ *   if (mml_load(r, song, strlen(song)) != MML_OK) {
+ *       printf("%s at %zu\n", mml_error_message(r), mml_error_position(r));
+ *   }
+ *   while ((count = mml_render(r, buffer, 512)) > 0) { ... }
+ *   mml_destroy(r);
+ *
+ * A renderer may only be used by one thread at a time.
+ *
+ * Build: clang++ -std=c++17 -O2 -c mml_capi.cpp, and link with the C++
+ * standard library.
+ *
+ * LICENSE: MIT, see mml.cpp.
+ */
+#ifndef MML_H
+#define MML_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define MML_API __attribute__((visibility("default")))
+#else
+#define MML_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum mml_status {
+    MML_OK = 0,
+    MML_ERROR_SYNTAX,           /* Bad song text, see mml_error_position */
+    MML_ERROR_LIMIT,            /* Song is over a limit, or too many events */
+    MML_ERROR_INVALID_ARGUMENT,
+    MML_ERROR_INTERNAL
+} mml_status;
+
+/* A note or rest, the same as MMLEvent in mml.cpp. note is -1 for a rest. */
+typedef struct mml_event {
+    int8_t   note;
+    uint16_t ticks;
+    uint8_t  vibrato;
+    uint8_t  glide;
+} mml_event;
+
+typedef struct mml_renderer mml_renderer;
+
+/* Makes a renderer for sample_rate (8000 to 192000) that can hold songs of
+ * up to max_events notes and rests. Returns NULL if out of memory or given
+ * a bad rate. */
+MML_API mml_renderer *mml_create(int sample_rate, size_t max_events);
+MML_API void mml_destroy(mml_renderer *renderer);
+
+/* Refuses songs longer than max_samples, or with more than max_parse
+ * characters between two notes, with MML_ERROR_LIMIT. 0 means no limit. */
+MML_API mml_status mml_set_limits(mml_renderer *renderer, uint64_t max_samples, size_t max_parse);
+
+/* Compiles song text to events in the caller's buffer, without loading it.
+ * *count is set to the number of events, even if over capacity, in which
+ * case MML_ERROR_LIMIT is returned. */
+MML_API mml_status mml_compile(mml_renderer *renderer, const char *song, size_t len,
+                               mml_event *events, size_t capacity, size_t *count);
+
+/* Loads song text, or compiled events, ready to render from the start. On
+ * failure the renderer has no song loaded. */
+MML_API mml_status mml_load(mml_renderer *renderer, const char *song, size_t len);
+MML_API mml_status mml_load_events(mml_renderer *renderer, const mml_event *events, size_t count);
+
+/* Length of the loaded song, and the number of samples left to render */
+MML_API uint64_t mml_length(const mml_renderer *renderer);
+MML_API uint64_t mml_remaining(const mml_renderer *renderer);
+
+/* Renders up to frames samples of 16 bit mono into buffer, and returns the
+ * number written, which is less than frames only at the end of the song. */
+MML_API size_t mml_render(mml_renderer *renderer, int16_t *buffer, size_t frames);
+
+/* The same, but as floats from -0.5 to 0.5 with channels (1 or 2)
+ * interleaved copies of each sample, so buffer must hold frames * channels
+ * floats. Returns 0 for any other number of channels. */
+MML_API size_t mml_render_float(mml_renderer *renderer, float *buffer, size_t frames, int channels);
+
+/* Moves back to the start of the loaded song */
+MML_API void mml_rewind(mml_renderer *renderer);
+
+/* Why the last load or compile failed, and the offset in the song text of
+ * the character that was wrong. The message is "" after a success. */
+MML_API const char *mml_error_message(const mml_renderer *renderer);
+MML_API size_t mml_error_position(const mml_renderer *renderer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MML_H */
@@ -0,0 +1,625 @@
+/**
+ * Benchmarks for mml.cpp. Times each stage of rendering a song on its own,
+ * and the whole thing end to end, and writes the results as JSON.
+ *
+ * Usage: mml_bench [--reps n] [--warmup n] [--filter text] [--song "song text"]
+ *                  [--scaling [--scaling-max seconds]] [--perf] [--out results.json]
+ *        mml_bench --compare base.json new.json [--threshold pct] [--alpha p]
+ *
+ * Every benchmark is run --warmup times untimed, then --reps times timed.
+ * Results include the median, mean, min and percentiles of the timed runs,
+ * throughput in items (samples, lookups or ticks) per second, and the time
+ * of every run. Only benchmarks whose name contains --filter are run. The
+ * JSON goes to --out, or stdout, and a summary goes to stderr.
+ *
+ * The kernel_ benchmarks time each combination of interpolation, sample type
+ * and channels that SongStream::Render can pick (see RenderKernel).
+ *
+ * The engine_ benchmarks render a scale in each octave, and with vibrato,
+ * with each SynthEngine, so the wavetables can be compared with the
+ * oversampled engines across the pitch range. The oversampled results also
+ * have the SNR of their output against the wavetables' (see
+ * RenderOversampled).
+ *
+ * --scaling adds parse and render benchmarks of synthetic songs (see
+ * GenerateSyntheticSong) from 1 second up to 10 hours of audio, or
+ * --scaling-max seconds, to show how the cost grows with song length. These
+ * render through SongStream into a fixed buffer, so memory use stays flat.
+ *
+ * Every result also counts the heap allocations and bytes allocated per run,
+ * the most the heap grew by during the runs, and the process's max RSS so
+ * far (see AllocMeter).
+ *
+ * --perf (Linux only) also reads hardware counters with perf_event_open
+ * around each timed run: cycles, instructions, L1D read misses and branch
+ * misses. Each result gets the mean of these per run, IPC, and misses per
+ * item. Counters that can't be opened (no PMU, a VM, or
+ * perf_event_paranoid too high) are left out with a warning, and the
+ * benchmarks still run.
+ *
+ * --compare reads two results files and, for each benchmark in both, prints
+ * the speedup of the new median over the base, and whether the difference is
+ * significant by a two sided Mann-Whitney U test on the times of every run.
+ * A benchmark has regressed if it is more than --threshold percent (default
+ * 5) slower and significant at --alpha (default 0.01). The exit code is 1 if
+ * anything regressed, or a benchmark in the base is missing from the new
+ * results, or either file has no results, for use as a check before merging.
+ *
+ * Compile: clang++ -std=c++17 -O2 -pthread mml_bench.cpp -o mml_bench
+ *
+ * LICENSE: MIT, see mml.cpp.
+ */
+#define MML_NO_MAIN
+#include "mml.cpp"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+constexpr size_t    BENCH_LOOKUPS = 1 << 20;
+constexpr const char *BENCH_TMP_FILE = "mml_bench_tmp.wav";
+constexpr size_t    BENCH_BLOCK_SIZE = 1 << 16;
+
+// Song lengths for --scaling, in seconds of audio
+const double scalingSeconds[] = { 1, 10, 60, 600, 3600, 36000 };
+
+// A set of hardware counters for the calling thread, which are counted
+// only between Start and Stop, and accumulate until Reset. Any counter
+// which the kernel won't give us is skipped.
+class PerfCounters {
+public:
+    enum { CYCLES, INSTRUCTIONS, L1D_MISSES, BRANCH_MISSES, NUM_COUNTERS };
+
+    PerfCounters() {
+        for (int i = 0; i < NUM_COUNTERS; i++) { fds[i] = -1; }
+    #ifdef __linux__
+        const uint64_t l1dReadMiss = PERF_COUNT_HW_CACHE_L1D |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        const struct { uint32_t type; uint64_t config; } events[NUM_COUNTERS] = {
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HW_CACHE, l1dReadMiss },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        };
+        for (int i = 0; i < NUM_COUNTERS; i++) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = events[i].type;
+            attr.config = events[i].config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    #endif
+    }
+
+    ~PerfCounters() {
+    #ifdef __linux__
+        for (int fd : fds) { if (fd >= 0) { close(fd); } }
+    #endif
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    bool IsAvailable(int counter) const { return fds[counter] >= 0; }
+
+    void Reset() { Control(PERF_EVENT_IOC_RESET); }
+    void Start() { Control(PERF_EVENT_IOC_ENABLE); }
+    void Stop() { Control(PERF_EVENT_IOC_DISABLE); }
+
+    // The count so far, scaled up if the kernel had to multiplex the
+    // counters, or -1 if unavailable
+    double Read(int counter) const {
+    #ifdef __linux__
+        uint64_t values[3]; // Value, time enabled, time running
+        if (fds[counter] < 0 || read(fds[counter], values, sizeof(values)) != sizeof(values)) {
+            return -1;
+        }
+        if (values[2] == 0) { return 0; }
+        return (double)values[0] * values[1] / values[2];
+    #else
+        (void)counter;
+        return -1;
+    #endif
+    }
+
+private:
+    int fds[NUM_COUNTERS];
+
+#ifdef __linux__
+    void Control(unsigned long request) {
+        for (int fd : fds) { if (fd >= 0) { ioctl(fd, request, 0); } }
+    }
+#else
+    enum { PERF_EVENT_IOC_RESET, PERF_EVENT_IOC_ENABLE, PERF_EVENT_IOC_DISABLE };
+    void Control(int) {}
+#endif
+};
+
+struct BenchOptions {
+    int reps = 20;
+    int warmup = 3;
+    std::string filter;
+    std::string song = demosong;
+    bool scaling = false;
+    double scalingMax = 36000;
+    PerfCounters *perf = nullptr; // Null unless --perf
+};
+
+struct BenchResult {
+    std::string name;
+    size_t items;              // Work done by one run, for throughput
+    std::vector<double> times; // Seconds taken by each timed run
+
+    // Anything else measured, reported as is
+    std::vector<std::pair<std::string, double>> counters;
+};
+
+// Results are added to this, so the compiler can't throw away the work
+volatile uint64_t benchSink;
+
+// Adds the mean hardware counts per run to result, and the ratios derived
+// from them, skipping any that weren't available
+void AddPerfCounters(BenchResult &result, const PerfCounters &perf, int reps) {
+    const char *names[PerfCounters::NUM_COUNTERS] = {
+        "cycles", "instructions", "l1d_misses", "branch_misses"
+    };
+    double counts[PerfCounters::NUM_COUNTERS];
+    for (int i = 0; i < PerfCounters::NUM_COUNTERS; i++) {
+        counts[i] = perf.Read(i);
+        if (counts[i] < 0) { continue; }
+        counts[i] /= reps;
+        result.counters.push_back({ names[i], counts[i] });
+    }
+
+    double cycles = counts[PerfCounters::CYCLES];
+    double instructions = counts[PerfCounters::INSTRUCTIONS];
+    if (cycles > 0 && instructions >= 0) {
+        result.counters.push_back({ "ipc", instructions / cycles });
+    }
+    if (result.items == 0) { return; }
+    if (counts[PerfCounters::L1D_MISSES] >= 0) {
+        result.counters.push_back({ "l1d_misses_per_item", 
+            counts[PerfCounters::L1D_MISSES] / result.items });
+    }
+    if (counts[PerfCounters::BRANCH_MISSES] >= 0) {
+        result.counters.push_back({ "branch_misses_per_item", 
+            counts[PerfCounters::BRANCH_MISSES] / result.items });
+    }
+}
+
+// Runs fn, which does one repetition of the benchmark and returns the
+// number of items it processed, the configured number of times. Returns the
+// result, so that counters can be added, or null if filtered out.
+template <typename F>
+BenchResult *RunBench(std::vector<BenchResult> &results, const BenchOptions &opts,
+                      const std::string &name, F &&fn) {
+    using namespace std::chrono;
+    if (name.find(opts.filter) == std::string::npos) { return nullptr; }
+
+    BenchResult result;
+    result.name = name;
+    for (int i = 0; i < opts.warmup; i++) { fn(); }
+    result.times.reserve(opts.reps); // So the runs' allocations are all fn's
+    if (opts.perf) { opts.perf->Reset(); }
+    AllocMeter meter;
+    for (int i = 0; i < opts.reps; i++) {
+        if (opts.perf) { opts.perf->Start(); }
+        auto start = steady_clock::now();
+        result.items = fn();
+        result.times.push_back(duration<double>(steady_clock::now() - start).count());
+        if (opts.perf) { opts.perf->Stop(); }
+    }
+    AllocCounts alloc = meter.Counts();
+    result.counters.push_back({ "allocations", (double)alloc.allocations / opts.reps });
+    result.counters.push_back({ "alloc_bytes", (double)alloc.bytes / opts.reps });
+    result.counters.push_back({ "peak_heap_bytes", (double)alloc.peakLive });
+    result.counters.push_back({ "max_rss_kb", (double)MaxRSSKB() });
+    if (opts.perf) { AddPerfCounters(result, *opts.perf, opts.reps); }
+    results.push_back(std::move(result));
+    return &results.back();
+}
+
+// Times one render kernel on the same 440Hz note as wavetable_lookup
+template <Interpolation Interp, typename Sample, int Channels>
+void BenchKernel(std::vector<BenchResult> &results, const BenchOptions &opts,
+                 const SquareWavetable &wavetable, const std::string &name) {
+    std::vector<Sample> buffer(BENCH_BLOCK_SIZE * Channels);
+    RunBench(results, opts, name, [&] {
+        uint32_t phase = 0, phaseRate = (uint32_t)(UINT32_MAX * (440.0 / SAMPLE_RATE));
+        size_t table = wavetable.GetTable(phaseRate);
+        for (size_t done = 0; done < BENCH_LOOKUPS; done += BENCH_BLOCK_SIZE) {
+            RenderKernel<SquareWavetable, Interp, Sample, Channels>(
+                wavetable, table, buffer.data(), BENCH_BLOCK_SIZE, phase, phaseRate, 0);
+            benchSink = benchSink + (uint64_t)buffer[phase % buffer.size()];
+        }
+        return BENCH_LOOKUPS;
+    });
+}
+
+// Nearest rank percentile of sorted
+double Percentile(const std::vector<double> &sorted, double pct) {
+    size_t rank = (size_t)std::ceil(pct / 100 * sorted.size());
+    return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+void WriteResults(std::ostream &out, const BenchOptions &opts,
+                  const std::vector<BenchResult> &results) {
+    out << "{\n  \"reps\": " << opts.reps << ",\n  \"warmup\": " << opts.warmup
+        << ",\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        auto &result = results[i];
+        auto sorted = result.times;
+        std::sort(sorted.begin(), sorted.end());
+        double mean = 0;
+        for (double time : sorted) { mean += time / sorted.size(); }
+        double median = Percentile(sorted, 50);
+
+        char buffer[512];
+        snprintf(buffer, sizeof(buffer),
+            "    {\"name\": \"%s\", \"items\": %zu, \"median_ns\": %.0f, "
+            "\"mean_ns\": %.0f, \"min_ns\": %.0f, \"p90_ns\": %.0f, \"p99_ns\": %.0f, "
+            "\"items_per_sec\": %.0f,\n     \"counters\": {",
+            result.name.c_str(), result.items, median * 1e9, mean * 1e9,
+            sorted[0] * 1e9, Percentile(sorted, 90) * 1e9, Percentile(sorted, 99) * 1e9,
+            result.items / median);
+        out << buffer;
+        for (size_t j = 0; j < result.counters.size(); j++) {
+            snprintf(buffer, sizeof(buffer), "%s\"%s\": %.17g", j ? ", " : "", 
+                result.counters[j].first.c_str(), result.counters[j].second);
+            out << buffer;
+        }
+        out << "},\n     \"times_ns\": [";
+        for (size_t j = 0; j < result.times.size(); j++) {
+            snprintf(buffer, sizeof(buffer), "%s%.0f", j ? ", " : "", result.times[j] * 1e9);
+            out << buffer;
+        }
+        out << "]}" << (i + 1 < results.size() ? "," : "") << "\n";
+
+        fprintf(stderr, "%-24s median %12.3f ms  p90 %12.3f ms  %14.0f items/s\n",
+            result.name.c_str(), median * 1e3, Percentile(sorted, 90) * 1e3,
+            result.items / median);
+    }
+    out << "  ]\n}\n";
+}
+
+// Reads the name and run times of each benchmark from a file written by
+// WriteResults. Only understands that format, not JSON in general. Throws
+// for a file with no benchmarks in it, or one cut off part way through.
+std::vector<BenchResult> ReadResults(const char *filename) {
+    std::ifstream in(filename);
+    if (!in) { throw std::runtime_error(std::string("Can't open ") + filename); }
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<BenchResult> results;
+
+    const std::string nameKey = "\"name\": \"", timesKey = "\"times_ns\": [";
+    size_t pos = 0;
+    while ((pos = text.find(nameKey, pos)) != std::string::npos) {
+        BenchResult result;
+        pos += nameKey.size();
+        size_t end = text.find('"', pos);
+        size_t times = text.find(timesKey, pos);
+        if (end == std::string::npos || times == std::string::npos) {
+            throw std::runtime_error(std::string("Truncated results in ") + filename);
+        }
+        result.name = text.substr(pos, end - pos);
+        result.items = 0;
+
+        const char *cursor = text.c_str() + times + timesKey.size();
+        while (*cursor != ']') {
+            if (!*cursor) {
+                throw std::runtime_error(std::string("Truncated results in ") + filename);
+            }
+            char *next;
+            double ns = strtod(cursor, &next);
+            if (next == cursor) {
+                throw std::runtime_error(std::string("Bad times_ns in ") + filename);
+            }
+            result.times.push_back(ns / 1e9);
+            cursor = next + strspn(next, ", \n");
+        }
+        if (result.times.empty()) {
+            throw std::runtime_error("No times for " + result.name + " in " + filename);
+        }
+        pos = cursor - text.c_str();
+        results.push_back(std::move(result));
+    }
+    if (results.empty()) {
+        throw std::runtime_error(std::string("No benchmarks in ") + filename);
+    }
+    return results;
+}
+
+// Two sided p value of the Mann-Whitney U test that a and b come from the
+// same distribution, using the normal approximation with a correction for
+// ties. Fine from about 8 runs each; the default is 20.
+double MannWhitneyP(const std::vector<double> &a, const std::vector<double> &b) {
+    std::vector<std::pair<double, int>> all; // Time, which sample
+    for (double x : a) { all.push_back({ x, 0 }); }
+    for (double x : b) { all.push_back({ x, 1 }); }
+    std::sort(all.begin(), all.end());
+
+    // Sum the ranks of a, giving tied values the mean of their ranks
+    double rankSumA = 0, tieTerm = 0;
+    for (size_t i = 0; i < all.size();) {
+        size_t j = i;
+        while (j < all.size() && all[j].first == all[i].first) { j++; }
+        double rank = (i + 1 + j) / 2.0, ties = j - i;
+        for (size_t k = i; k < j; k++) { 
+            if (all[k].second == 0) { rankSumA += rank; }
+        }
+        tieTerm += ties * ties * ties - ties;
+        i = j;
+    }
+
+    double n1 = a.size(), n2 = b.size(), n = n1 + n2;
+    double u = rankSumA - n1 * (n1 + 1) / 2;
+    double mean = n1 * n2 / 2;
+    double variance = n1 * n2 / 12 * ((n + 1) - tieTerm / (n * (n - 1)));
+    if (variance <= 0) { return 1; }
+    double z = std::max(std::fabs(u - mean) - 0.5, 0.0) / std::sqrt(variance);
+    return std::erfc(z / std::sqrt(2.0));
+}
+
+// Compares the benchmarks in both files, and returns the number that
+// regressed, counting any in the base file but missing from the new one
+int CompareResults(const char *baseFile, const char *newFile, double threshold, double alpha) {
+    auto base = ReadResults(baseFile), next = ReadResults(newFile);
+    int regressions = 0, missing = 0;
+
+    printf("%-24s %14s %14s %9s %9s\n", "Benchmark", "Base (ms)", "New (ms)", "Speedup", "p");
+    for (auto &result : next) {
+        auto old = std::find_if(base.begin(), base.end(), 
+            [&](const BenchResult &r) { return r.name == result.name; });
+        if (old == base.end()) {
+            printf("%-24s (not in %s)\n", result.name.c_str(), baseFile);
+            continue;
+        }
+
+        auto oldSorted = old->times, newSorted = result.times;
+        std::sort(oldSorted.begin(), oldSorted.end());
+        std::sort(newSorted.begin(), newSorted.end());
+        double oldMedian = Percentile(oldSorted, 50), newMedian = Percentile(newSorted, 50);
+        double speedup = oldMedian / newMedian;
+        double p = MannWhitneyP(old->times, result.times);
+
+        const char *verdict = "";
+        if (p < alpha) {
+            if (newMedian > oldMedian * (1 + threshold / 100)) {
+                verdict = "REGRESSION";
+                regressions++;
+            } else if (newMedian < oldMedian) {
+                verdict = "faster";
+            } else {
+                verdict = "slower";
+            }
+        }
+        printf("%-24s %14.3f %14.3f %8.3fx %9.2g %s\n", result.name.c_str(), 
+            oldMedian * 1e3, newMedian * 1e3, speedup, p, verdict);
+    }
+    for (auto &old : base) {
+        bool found = std::any_of(next.begin(), next.end(), 
+            [&](const BenchResult &r) { return r.name == old.name; });
+        if (!found) {
+            printf("%-24s MISSING from %s\n", old.name.c_str(), newFile);
+            missing++;
+        }
+    }
+    printf("%d regression%s over %g%% at p < %g", 
+        regressions, regressions == 1 ? "" : "s", threshold, alpha);
+    if (missing) { printf(", %d benchmark%s missing", missing, missing == 1 ? "" : "s"); }
+    printf("\n");
+    return regressions + missing;
+}
+
+int main(int argc, char **argv) {
+    BenchOptions opts;
+    const char *outFile = nullptr;
+    bool usePerf = false;
+
+    try {
+        const char *compare[2] = { nullptr, nullptr };
+        double threshold = 5, alpha = 0.01;
+        for (int arg = 1; arg < argc; arg++) {
+            if (!strcmp(argv[arg], "--compare") && arg + 2 < argc) {
+                compare[0] = argv[++arg];
+                compare[1] = argv[++arg];
+            } else if (!strcmp(argv[arg], "--threshold") && arg + 1 < argc) {
+                threshold = atof(argv[++arg]);
+            } else if (!strcmp(argv[arg], "--alpha") && arg + 1 < argc) {
+                alpha = atof(argv[++arg]);
+            } else if (!strcmp(argv[arg], "--reps") && arg + 1 < argc) {
+                opts.reps = std::max(atoi(argv[++arg]), 1);
+            } else if (!strcmp(argv[arg], "--warmup") && arg + 1 < argc) {
+                opts.warmup = std::max(atoi(argv[++arg]), 0);
+            } else if (!strcmp(argv[arg], "--filter") && arg + 1 < argc) {
+                opts.filter = argv[++arg];
+            } else if (!strcmp(argv[arg], "--song") && arg + 1 < argc) {
+                opts.song = argv[++arg];
+            } else if (!strcmp(argv[arg], "--scaling")) {
+                opts.scaling = true;
+            } else if (!strcmp(argv[arg], "--scaling-max") && arg + 1 < argc) {
+                opts.scalingMax = atof(argv[++arg]);
+            } else if (!strcmp(argv[arg], "--perf")) {
+                usePerf = true;
+            } else if (!strcmp(argv[arg], "--out") && arg + 1 < argc) {
+                outFile = argv[++arg];
+            } else {
+                throw std::invalid_argument(std::string("Unknown option ") + argv[arg]);
+            }
+        }
+
+        if (compare[0]) {
+            return CompareResults(compare[0], compare[1], threshold, alpha) ? 1 : 0;
+        }
+
+        std::unique_ptr<PerfCounters> perf;
+        if (usePerf) {
+            perf.reset(new PerfCounters);
+            const char *names[] = { "cycles", "instructions", "L1D misses", "branch misses" };
+            int available = 0;
+            for (int i = 0; i < PerfCounters::NUM_COUNTERS; i++) {
+                if (perf->IsAvailable(i)) {
+                    available++;
+                } else {
+                    fprintf(stderr, "Warning: can't count %s, leaving it out\n", names[i]);
+                }
+            }
+            if (available) { opts.perf = perf.get(); }
+        }
+
+        const char *song = opts.song.c_str();
+        int len = opts.song.size();
+        auto songData = GenerateSongSquareWave(song, len);
+        std::vector<BenchResult> results;
+
+        RunBench(results, opts, "wavetable_generate", [] {
+            SquareWavetable wavetable(SAMPLE_RATE);
+            benchSink = benchSink + wavetable.GetTable(0);
+            return WAVETABLE_NUM_TABLES * WAVETABLE_SIZE;
+        });
+
+        SquareWavetable wavetable(SAMPLE_RATE);
+        RunBench(results, opts, "wavetable_lookup", [&] {
+            // A 440Hz note, the middle of the range the player uses
+            uint32_t phase = 0, phaseRate = (uint32_t)(UINT32_MAX * (440.0 / SAMPLE_RATE));
+            size_t table = wavetable.GetTable(phaseRate);
+            float sum = 0;
+            for (size_t i = 0; i < BENCH_LOOKUPS; i++) {
+                sum += wavetable.Lookup(phase, table);
+                phase += phaseRate;
+            }
+            benchSink = benchSink + (uint64_t)sum;
+            return BENCH_LOOKUPS;
+        });
+
+        // Every render kernel that SongStream can pick
+        BenchKernel<Interpolation::Linear, int16_t, 1>(results, opts, wavetable, "kernel_linear_i16_mono");
+        BenchKernel<Interpolation::Linear, int16_t, 2>(results, opts, wavetable, "kernel_linear_i16_stereo");
+        BenchKernel<Interpolation::Linear, float, 1>(results, opts, wavetable, "kernel_linear_f32_mono");
+        BenchKernel<Interpolation::Linear, float, 2>(results, opts, wavetable, "kernel_linear_f32_stereo");
+        BenchKernel<Interpolation::Nearest, int16_t, 1>(results, opts, wavetable, "kernel_nearest_i16_mono");
+        BenchKernel<Interpolation::Nearest, int16_t, 2>(results, opts, wavetable, "kernel_nearest_i16_stereo");
+        BenchKernel<Interpolation::Nearest, float, 1>(results, opts, wavetable, "kernel_nearest_f32_mono");
+        BenchKernel<Interpolation::Nearest, float, 2>(results, opts, wavetable, "kernel_nearest_f32_stereo");
+
+        const char *engineNames[] = { "wavetable", "oversampled4x", "oversampled8x" };
+        std::vector<std::pair<std::string, std::string>> scales;
+        for (int octave = 0; octave < NUM_OCTAVES; octave++) {
+            std::string o = std::to_string(octave);
+            scales.push_back({ "octave" + o, "t0 o" + o + " c5d5e5f5g5a5b5" });
+        }
+        scales.push_back({ "vibrato", "t0 o1 m9 c5d5e5f5g5a5b5" });
+        std::vector<int16_t> block(BENCH_BLOCK_SIZE);
+        for (auto &scale : scales) {
+            auto wavetableOutput = RenderSong(scale.second.data(), scale.second.size());
+            for (int e = 0; e < 3; e++) {
+                SongStream stream(SAMPLE_RATE);
+                stream.SetEngine((SynthEngine)e);
+                stream.Load(scale.second.data(), scale.second.size());
+                auto *result = RunBench(results, opts, 
+                                        std::string("engine_") + engineNames[e] + "_" + scale.first, [&] {
+                    stream.Rewind();
+                    size_t total = 0;
+                    while (size_t count = stream.Render(block.data(), block.size())) {
+                        total += count;
+                        benchSink = benchSink + block[0];
+                    }
+                    return total;
+                });
+                if (result && e > 0) {
+                    auto output = RenderOversampled(scale.second, SAMPLE_RATE, (SynthEngine)e);
+                    result->counters.push_back({ "snr_vs_wavetable_db", 
+                                                 CompareOutput(wavetableOutput, output).snr });
+                }
+            }
+        }
+
+        RunBench(results, opts, "player_tick", [&] {
+            MMLPlayer player(SAMPLE_RATE, song, len);
+            size_t ticks = 0;
+            uint32_t sum = 0;
+            for (; !player.IsDone(); ticks++) { sum += player.Tick(); }
+            benchSink = benchSink + sum;
+            return ticks;
+        });
+
+        RunBench(results, opts, "generate_song", [&] {
+            auto data = GenerateSongSquareWave(song, len);
+            benchSink = benchSink + data.size();
+            return data.size();
+        });
+
+        RunBench(results, opts, "song_stream", [&] {
+            auto data = RenderSong(song, len);
+            benchSink = benchSink + data.size();
+            return data.size();
+        });
+
+        RunBench(results, opts, "write_wave_file", [&] {
+            WriteMonoWaveFile(BENCH_TMP_FILE, songData.data(), songData.size());
+            return songData.size();
+        });
+
+        RunBench(results, opts, "end_to_end", [&] {
+            auto data = RenderSong(song, len);
+            WriteMonoWaveFile(BENCH_TMP_FILE, data.data(), data.size());
+            return data.size();
+        });
+        remove(BENCH_TMP_FILE);
+
+        for (double seconds : scalingSeconds) {
+            if (!opts.scaling || seconds > opts.scalingMax) { break; }
+            SyntheticSongParams params;
+            params.seconds = seconds;
+            std::string synth = GenerateSyntheticSong(params);
+            std::string suffix = "_" + std::to_string((int)seconds) + "s";
+
+            size_t numEvents = 0;
+            auto *result = RunBench(results, opts, "scaling_parse" + suffix, [&] {
+                MMLPlayer player(SAMPLE_RATE, synth.data(), synth.size());
+                MMLEvent ev;
+                numEvents = 0;
+                while (player.NextEvent(ev)) { numEvents++; }
+                return numEvents;
+            });
+            if (result) {
+                result->counters.push_back({ "text_bytes", (double)synth.size() });
+                result->counters.push_back({ "event_bytes", (double)numEvents * sizeof(MMLEvent) });
+            }
+
+            std::vector<int16_t> block(BENCH_BLOCK_SIZE);
+            result = RunBench(results, opts, "scaling_render" + suffix, [&] {
+                SongStream stream(SAMPLE_RATE, synth.data(), synth.size());
+                size_t total = 0;
+                while (size_t count = stream.Render(block.data(), block.size())) {
+                    total += count;
+                    benchSink = benchSink + block[0];
+                }
+                return total;
+            });
+            if (result) {
+                result->counters.push_back({ "output_bytes", (double)result->items * sizeof(int16_t) });
+            }
+        }
+
+        if (outFile) {
+            std::ofstream out(outFile);
+            out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+            WriteResults(out, opts, results);
+        } else {
+            WriteResults(std::cout, opts, results);
+        }
+    } catch (const std::exception &err) {
+        std::cout << "Error: " << err.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,215 @@
+/**
+ * The C interface to mml.cpp declared in mml.h. Everything here catches
+ * whatever mml.cpp throws and turns it into an mml_status, and everything
+ * after mml_create works in memory it set up.
+ *
+ * Compile: clang++ -std=c++17 -O2 -c mml_capi.cpp
+ *
+ * Everything from mml.cpp has internal linkage or hidden visibility, so a
+ * shared library built from this exports only the mml_ functions, besides
+ * the weak std:: template instances the C++ runtime shares anyway. For a
+ * static object, objcopy --localize-hidden mml_capi.o keeps the hidden C++
+ * symbols from clashing with the program's too.
+ *
+ * LICENSE: MIT, see mml.cpp.
+ */
+#define MML_NO_MAIN
+#define MML_NO_ALLOC_HOOK // Leave the host program's operator new alone
+#define MML_HIDE_SYMBOLS  // Only the mml_ functions are exported
+#include "mml.cpp"
+#include "mml.h"
+
+#include <climits>
+
+static_assert(sizeof(mml_event) == sizeof(MMLEvent) &&
+              offsetof(mml_event, note) == offsetof(MMLEvent, note) &&
+              offsetof(mml_event, ticks) == offsetof(MMLEvent, ticks) &&
+              offsetof(mml_event, vibrato) == offsetof(MMLEvent, vibrato) &&
+              offsetof(mml_event, glide) == offsetof(MMLEvent, glide),
+              "mml_event must match MMLEvent");
+
+struct MML_HIDDEN mml_renderer {
+    SongStream stream;
+    std::vector<MMLEvent> events; // Room for the most events a song can have
+    RenderLimits limits;
+    bool loaded;
+    uint64_t rendered;
+    const char *errorMessage;
+    size_t errorPosition;
+
+    mml_renderer(int sampleRate, size_t maxEvents) :
+        stream(sampleRate), events(maxEvents), loaded(false), rendered(0), 
+        errorMessage(""), errorPosition(0) {
+        // Generate every table and make room for the longest song now, so
+        // that loading never allocates
+        stream.Reserve(maxEvents);
+        stream.LoadEvents(nullptr, 0);
+    }
+
+    mml_status Fail(mml_status status, const char *message, size_t position) {
+        errorMessage = message;
+        errorPosition = position;
+        return status;
+    }
+
+    // So that a failed load leaves nothing to render
+    void Unload() { loaded = false; }
+
+    mml_status Compile(const char *song, size_t len, MMLEvent *out, size_t capacity,
+                       size_t *count) {
+        if (!song || len > INT_MAX) { return Fail(MML_ERROR_INVALID_ARGUMENT, "Bad song text", 0); }
+        MMLParseState state;
+        MMLParseError error;
+        MMLEvent ev = {};
+        size_t numEvents = 0;
+        while (MMLParseEvent(song, (int)len, state, ev, limits.maxParseWork, &error)) {
+            if (numEvents < capacity) { out[numEvents] = ev; }
+            numEvents++;
+        }
+        *count = numEvents;
+
+        if (error.message) {
+            return Fail(error.overLimit ? MML_ERROR_LIMIT : MML_ERROR_SYNTAX,
+                        error.message, error.position);
+        }
+        if (numEvents > capacity) {
+            return Fail(MML_ERROR_LIMIT, "Song has more events than there is room for", len);
+        }
+        return Fail(MML_OK, "", 0);
+    }
+
+    mml_status Load(const MMLEvent *songEvents, size_t count) {
+        if (count > events.size()) {
+            Unload();
+            return Fail(MML_ERROR_LIMIT, "Song has more events than there is room for", 0);
+        }
+
+        // Check the length here, as SongStream would throw
+        uint64_t ticks = 1; // For the final rest SongStream adds
+        for (size_t i = 0; i < count; i++) { ticks += songEvents[i].ticks; }
+        if (ticks * stream.TickLength() > (double)limits.maxOutputSamples) {
+            Unload();
+            return Fail(MML_ERROR_LIMIT, "Song is longer than the output limit", 0);
+        }
+
+        stream.LoadEvents(songEvents, count);
+        loaded = true;
+        rendered = 0;
+        return MML_OK;
+    }
+};
+
+extern "C" {
+
+mml_renderer *mml_create(int sample_rate, size_t max_events) {
+    if (sample_rate < 8000 || sample_rate > 192000) { return nullptr; }
+    try {
+        return new mml_renderer(sample_rate, max_events);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void mml_destroy(mml_renderer *renderer) { delete renderer; }
+
+mml_status mml_set_limits(mml_renderer *renderer, uint64_t max_samples, size_t max_parse) {
+    if (!renderer) { return MML_ERROR_INVALID_ARGUMENT; }
+    renderer->limits.maxOutputSamples = max_samples ? max_samples : SIZE_MAX;
+    renderer->limits.maxParseWork = max_parse ? max_parse : SIZE_MAX;
+    return MML_OK;
+}
+
+mml_status mml_compile(mml_renderer *renderer, const char *song, size_t len,
+                       mml_event *events, size_t capacity, size_t *count) {
+    if (!renderer || !count || (!events && capacity)) { return MML_ERROR_INVALID_ARGUMENT; }
+    try {
+        return renderer->Compile(song, len, (MMLEvent*)events, capacity, count);
+    } catch (...) {
+        return renderer->Fail(MML_ERROR_INTERNAL, "Internal error", 0);
+    }
+}
+
+mml_status mml_load(mml_renderer *renderer, const char *song, size_t len) {
+    if (!renderer) { return MML_ERROR_INVALID_ARGUMENT; }
+    try {
+        size_t count = 0;
+        auto &events = renderer->events;
+        mml_status status = renderer->Compile(song, len, events.data(), events.size(), &count);
+        if (status != MML_OK) {
+            renderer->Unload();
+            return status;
+        }
+        return renderer->Load(events.data(), count);
+    } catch (...) {
+        return renderer->Fail(MML_ERROR_INTERNAL, "Internal error", 0);
+    }
+}
+
+mml_status mml_load_events(mml_renderer *renderer, const mml_event *events, size_t count) {
+    if (!renderer || (!events && count)) { return MML_ERROR_INVALID_ARGUMENT; }
+    try {
+        for (size_t i = 0; i < count; i++) {
+            if (events[i].ticks == 0 || events[i].note < MML_REST ||
+                events[i].note >= NUM_OCTAVES * NOTES_PER_OCTAVE) {
+                renderer->Unload();
+                return renderer->Fail(MML_ERROR_INVALID_ARGUMENT, "Bad event", i);
+            }
+        }
+        mml_status status = renderer->Load((const MMLEvent*)events, count);
+        if (status == MML_OK) { renderer->Fail(MML_OK, "", 0); }
+        return status;
+    } catch (...) {
+        return renderer->Fail(MML_ERROR_INTERNAL, "Internal error", 0);
+    }
+}
+
+uint64_t mml_length(const mml_renderer *renderer) {
+    return renderer && renderer->loaded ? renderer->stream.TotalSamples() : 0;
+}
+
+uint64_t mml_remaining(const mml_renderer *renderer) {
+    return renderer && renderer->loaded ? renderer->stream.TotalSamples() - renderer->rendered : 0;
+}
+
+size_t mml_render(mml_renderer *renderer, int16_t *buffer, size_t frames) {
+    if (!renderer || !buffer || !renderer->loaded) { return 0; }
+    try {
+        size_t count = renderer->stream.Render(buffer, frames);
+        renderer->rendered += count;
+        return count;
+    } catch (...) {
+        return 0; // Render doesn't throw after LoadEvents, but just in case
+    }
+}
+
+size_t mml_render_float(mml_renderer *renderer, float *buffer, size_t frames, int channels) {
+    if (!renderer || !buffer || !renderer->loaded) { return 0; }
+    try {
+        size_t count = 0;
+        switch (channels) {
+            case 1: count = renderer->stream.Render<float, 1>(buffer, frames); break;
+            case 2: count = renderer->stream.Render<float, 2>(buffer, frames); break;
+            default: return 0;
+        }
+        renderer->rendered += count;
+        return count;
+    } catch (...) {
+        return 0;
+    }
+}
+
+void mml_rewind(mml_renderer *renderer) {
+    if (!renderer) { return; }
+    renderer->stream.Rewind();
+    renderer->rendered = 0;
+}
+
+const char *mml_error_message(const mml_renderer *renderer) {
+    return renderer ? renderer->errorMessage : "No renderer";
+}
+
+size_t mml_error_position(const mml_renderer *renderer) {
+    return renderer ? renderer->errorPosition : 0;
+}
+
+}
@@ -0,0 +1,249 @@
+/**
+ * Fuzzing for mml.cpp. Looks for songs that crash the parser or renderer, and
+ * for songs that are the most expensive for their size: the most output
+ * samples, or the most time to load and render, per byte of song text.
+ *
+ * Usage: mml_fuzz [--iterations n] [--max-len bytes] [--seed n] [--out dir]
+ *
+ * Starts from a few seed songs and keeps mutating the worst ones found so far
+ * for each measure, keeping any mutant that is worse still. Every input is
+ * rendered through SongStream under FuzzLimits, so that no one input runs for
+ * long. Anything thrown other than std::domain_error or RenderLimitExceeded
+ * is reported as a crash; compiling with -fsanitize=address,undefined also
+ * catches memory errors, and with --out the input being run is always in
+ * dir/last_input.mml for when one kills the process. At the end the worst
+ * inputs for each measure are printed, and written to --out if given.
+ *
+ * Compiling with -DMML_LIBFUZZER -fsanitize=fuzzer makes this a libFuzzer
+ * target instead, which renders each input under the same limits.
+ *
+ * Compile: clang++ -std=c++17 -O2 -pthread mml_fuzz.cpp -o mml_fuzz
+ *
+ * LICENSE: MIT, see mml.cpp.
+ */
+#define MML_NO_MAIN
+#include "mml.cpp"
+
+constexpr size_t    FUZZ_POOL_SIZE = 8;   // Inputs kept per measure
+constexpr size_t    FUZZ_BLOCK_SIZE = 4096;
+constexpr int       FUZZ_TIMING_RUNS = 2; // Time is the fastest of these
+
+// A minute of audio is plenty to tell expensive inputs apart
+RenderLimits FuzzLimits() {
+    RenderLimits limits;
+    limits.maxOutputSamples = 60 * SAMPLE_RATE;
+    return limits;
+}
+
+struct FuzzResult {
+    bool   valid = false;  // Rendered, rather than rejected
+    size_t samples = 0;    // That the song would be without limits, if valid
+    double seconds = 0;
+};
+
+// Loads and renders input, timing it. Bad songs and songs over the limits
+// are rejected as usual; anything else thrown is left to the caller. The
+// stream is kept between inputs, so that the time is the song's alone and
+// not building the wavetables.
+FuzzResult RunInput(const std::string &input) {
+    static std::array<int16_t, FUZZ_BLOCK_SIZE> block;
+    static SongStream stream(SAMPLE_RATE);
+    static bool setUp = false;
+    if (!setUp) {
+        stream.SetLimits(FuzzLimits());
+        setUp = true;
+    }
+
+    FuzzResult result;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        stream.Load(input.data(), input.size());
+        result.samples = stream.TotalSamples();
+        while (stream.Render(block.data(), block.size())) {}
+        result.valid = true;
+    } catch (const std::domain_error &) {
+    } catch (const RenderLimitExceeded &) {
+        // Over the output limit is as bad as it gets for samples per byte
+        result.samples = FuzzLimits().maxOutputSamples;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+#ifdef MML_LIBFUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    RunInput(std::string((const char*)data, size));
+    return 0;
+}
+#else
+
+struct FuzzInput {
+    std::string text;
+    double      score; // Higher is worse, ie. more interesting
+};
+
+// Pieces of song that mutations insert, to get past the parser more often
+// than random bytes would
+const char *fuzzTokens[] = {
+    "C9", "R9", "B#9", "C-0", "T9", "T0", "O0", "O2", ">", "<", "M9", "P9",
+    " ", "\n", "#", "-", "9", "0"
+};
+
+std::string Mutate(std::string text, SplitMix64 &rng, size_t maxLen) {
+    int mutations = 1 + rng.Below(4);
+    for (int i = 0; i < mutations; i++) {
+        size_t pos = text.empty() ? 0 : rng.Below(text.size() + 1);
+        switch (rng.Below(5)) {
+            case 0: // Insert a token
+                text.insert(pos, fuzzTokens[rng.Below(std::size(fuzzTokens))]);
+                break;
+            case 1: // Insert any byte
+                text.insert(text.begin() + pos, (char)rng.Below(256));
+                break;
+            case 2: // Delete a range
+                if (!text.empty()) {
+                    pos = std::min(pos, text.size() - 1);
+                    text.erase(pos, 1 + rng.Below(std::min<size_t>(text.size() - pos, 8)));
+                }
+                break;
+            case 3: // Duplicate a range, which finds runs of expensive pieces
+                if (!text.empty()) {
+                    pos = std::min(pos, text.size() - 1);
+                    size_t len = 1 + rng.Below(std::min<size_t>(text.size() - pos, 16));
+                    text.insert(pos, text.substr(pos, len));
+                }
+                break;
+            case 4: // Replace a byte with a token's first character
+                if (!text.empty()) {
+                    pos = std::min(pos, text.size() - 1);
+                    text[pos] = fuzzTokens[rng.Below(std::size(fuzzTokens))][0];
+                }
+                break;
+        }
+    }
+    if (text.size() > maxLen) { text.resize(maxLen); }
+    return text;
+}
+
+// Adds input to pool if it is worse than the least bad one there
+void Offer(std::vector<FuzzInput> &pool, const std::string &text, double score) {
+    for (auto &input : pool) {
+        if (input.text == text) { return; }
+    }
+    if (pool.size() < FUZZ_POOL_SIZE) {
+        pool.push_back({ text, score });
+    } else {
+        auto least = std::min_element(pool.begin(), pool.end(),
+            [](const FuzzInput &a, const FuzzInput &b) { return a.score < b.score; });
+        if (score <= least->score) { return; }
+        *least = { text, score };
+    }
+}
+
+// text with anything unprintable escaped, for the terminal
+std::string Escape(const std::string &text) {
+    std::string out;
+    char hex[8];
+    for (unsigned char c : text) {
+        if (c >= 32 && c < 127 && c != '\\') {
+            out += c;
+        } else {
+            snprintf(hex, sizeof(hex), "\\x%02x", c);
+            out += hex;
+        }
+    }
+    return out;
+}
+
+void WriteFile(const std::string &filename, const std::string &text) {
+    std::ofstream out(filename, std::ios::binary);
+    out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+    out.write(text.data(), text.size());
+}
+
+int main(int argc, char **argv) {
+    long iterations = 20000;
+    size_t maxLen = 64;
+    uint64_t seed = 1;
+    const char *outDir = nullptr;
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "--iterations") && arg + 1 < argc) {
+            iterations = atol(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--max-len") && arg + 1 < argc) {
+            maxLen = std::max(atoi(argv[++arg]), 1);
+        } else if (!strcmp(argv[arg], "--seed") && arg + 1 < argc) {
+            seed = strtoull(argv[++arg], nullptr, 10);
+        } else if (!strcmp(argv[arg], "--out") && arg + 1 < argc) {
+            outDir = argv[++arg];
+        } else {
+            std::cout << "Unknown option " << argv[arg] << "\n";
+            return 1;
+        }
+    }
+
+    const char *measures[] = { "samples per byte", "seconds per byte" };
+    std::vector<FuzzInput> pools[2];
+    std::vector<std::string> crashes;
+    SplitMix64 rng(seed);
+    std::string lastInput = outDir ? std::string(outDir) + "/last_input.mml" : "";
+
+    std::vector<std::string> queue = {
+        demosong.substr(0, maxLen), "C9", "T9C9", "O2B#9", "  ", "<>", "M9P9C9D9"
+    };
+    for (long i = 0; i < iterations; i++) {
+        std::string text;
+        if (!queue.empty()) {
+            text = queue.back();
+            queue.pop_back();
+        } else {
+            auto &pool = pools[rng.Below(2)];
+            text = Mutate(pool[rng.Below(pool.size())].text, rng, maxLen);
+        }
+        if (text.empty()) { continue; }
+        if (outDir) { WriteFile(lastInput, text); }
+
+        FuzzResult result;
+        try {
+            double seconds = INFINITY;
+            for (int run = 0; run < FUZZ_TIMING_RUNS; run++) {
+                result = RunInput(text);
+                seconds = std::min(seconds, result.seconds);
+            }
+            result.seconds = seconds;
+        } catch (const std::exception &err) {
+            printf("CRASH (%s): \"%s\"\n", err.what(), Escape(text).c_str());
+            crashes.push_back(text);
+            continue;
+        } catch (...) {
+            printf("CRASH (unknown exception): \"%s\"\n", Escape(text).c_str());
+            crashes.push_back(text);
+            continue;
+        }
+
+        Offer(pools[0], text, (double)result.samples / text.size());
+        Offer(pools[1], text, result.seconds / text.size());
+    }
+
+    for (int measure = 0; measure < 2; measure++) {
+        auto &pool = pools[measure];
+        std::sort(pool.begin(), pool.end(),
+            [](const FuzzInput &a, const FuzzInput &b) { return a.score > b.score; });
+        printf("Worst %s:\n", measures[measure]);
+        for (size_t i = 0; i < pool.size(); i++) {
+            printf("  %12.4g  \"%s\"\n", pool[i].score, Escape(pool[i].text).c_str());
+            if (outDir) {
+                WriteFile(std::string(outDir) + "/" + (measure ? "time_" : "samples_") +
+                          std::to_string(i) + ".mml", pool[i].text);
+            }
+        }
+    }
+    for (size_t i = 0; outDir && i < crashes.size(); i++) {
+        WriteFile(std::string(outDir) + "/crash_" + std::to_string(i) + ".mml", crashes[i]);
+    }
+    if (outDir) { remove(lastInput.c_str()); }
+    printf("%zu crashes\n", crashes.size());
+
+    return crashes.empty() ? 0 : 1;
+}
+#endif